@@ -9,9 +9,17 @@
 #define _APPLICATION_H_
 
 /* Control command for application packets */
-typedef enum { DUMMY, DATA, START, STOP } ctrlCmd;
+typedef enum { DUMMY, DATA, START, STOP, SIGNATURE, COPY } ctrlCmd;
 /* Parameter command for application packets */
-typedef enum { SIZE, NAME } paramCmd;
+typedef enum { SIZE, NAME, BLOCK, DIGEST } paramCmd;
+
+/*
+ * Delta synchronisation packets
+ * SIGNATURE: [SIGNATURE][n][n * (weak (4) | strong (8))], n = 0 ends the list
+ * COPY: [COPY][index of the first block (4)][number of blocks (2)]
+ */
+#define SIG_SIZE 12
+#define SIGS_PER_PACKET ((MAX_PACKET_SIZE - 2) / SIG_SIZE)
 
 #endif /* _APPLICATION_H_ */
 
@@ -0,0 +1,126 @@
+/*
+ * delta.c
+ * Serial port delta synchronisation utilitary functions
+ * RC @ L.EIC 2122
+ * Authors: Miguel Rodrigues & Nuno Castro
+ */
+
+#include "delta.h"
+
+/* macros */
+#define HASH_BITS 16
+#define HASH(w) ((w ^ (w >> HASH_BITS)) & ((1 << HASH_BITS) - 1))
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/* global variables */
+static const struct signature *signatures;
+static int64_t *buckets, *chain;
+
+
+uint16_t
+delta_block_size(const off_t size)
+{
+        off_t bs = MIN_BLOCK_SIZE;
+        while (bs < MAX_BLOCK_SIZE && bs * bs < size)
+                bs <<= 1;
+
+        return bs;
+}
+
+uint32_t
+weak_sum(const uint8_t *buf, const size_t len)
+{
+        uint32_t a = 0, b = 0;
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                a += buf[i];
+                b += (len - i) * buf[i];
+        }
+
+        return (a & 0xffff) | (b << 16);
+}
+
+uint32_t
+weak_roll(const uint32_t sum, const uint8_t out, const uint8_t in, const size_t len)
+{
+        uint32_t a = sum & 0xffff, b = sum >> 16;
+
+        a = a - out + in;
+        b = b - len * out + a;
+
+        return (a & 0xffff) | (b << 16);
+}
+
+uint64_t
+strong_sum(const uint8_t *buf, const size_t len)
+{
+        uint64_t h = FNV_OFFSET;
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                h ^= buf[i];
+                h *= FNV_PRIME;
+        }
+
+        return h;
+}
+
+
+
+int
+delta_index(const struct signature *sigs, const uint32_t n)
+{
+        int64_t i;
+
+        buckets = (int64_t *)malloc(sizeof(int64_t) << HASH_BITS);
+        chain = (int64_t *)malloc(sizeof(int64_t) * (n ? n : 1));
+        if (buckets == NULL || chain == NULL)
+                return -1;
+
+        for (i = 0; i < 1 << HASH_BITS; i++)
+                buckets[i] = -1;
+
+        /* inserted backwards so that lower indexes are found first */
+        for (i = (int64_t)n - 1; i >= 0; i--) {
+                chain[i] = buckets[HASH(sigs[i].weak)];
+                buckets[HASH(sigs[i].weak)] = i;
+        }
+
+        signatures = sigs;
+        return 0;
+}
+
+int64_t
+delta_match(const uint32_t weak, const uint8_t *buf, const size_t len)
+{
+        int64_t i;
+        uint64_t strong;
+        int strong_done = 0;
+
+        for (i = buckets[HASH(weak)]; i >= 0; i = chain[i]) {
+                if (signatures[i].weak != weak)
+                        continue;
+
+                if (!strong_done) {
+                        strong = strong_sum(buf, len);
+                        strong_done = 1;
+                }
+
+                if (signatures[i].strong == strong)
+                        return i;
+        }
+
+        return -1;
+}
+
+void
+delta_free(void)
+{
+        free(buckets);
+        free(chain);
+        buckets = chain = NULL;
+        signatures = NULL;
+}
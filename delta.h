@@ -0,0 +1,79 @@
+/*
+ * delta.h
+ * Serial port delta synchronisation utilitary functions
+ * RC @ L.EIC 2122
+ * Authors: Miguel Rodrigues & Nuno Castro
+ */
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#define MIN_BLOCK_SIZE 256
+#define MAX_BLOCK_SIZE 16384
+
+/* Checksums of a block of the receiver's copy of the file */
+struct signature {
+        uint32_t weak;
+        uint64_t strong;
+};
+
+/***
+ * Chooses the block size for a file, close to the square root of its size
+ * @param const off_t[in] - size of the file in bytes
+ * @param uint16_t[out] - block size in bytes
+ */
+uint16_t delta_block_size(const off_t size);
+
+/***
+ * Computes the rolling checksum of a block
+ * @param const uint8_t *[in] - block
+ * @param const size_t[in] - size of the block in bytes
+ * @param uint32_t[out] - rolling checksum
+ */
+uint32_t weak_sum(const uint8_t *buf, const size_t len);
+
+/***
+ * Slides the rolling checksum of a block one byte forward
+ * @param const uint32_t[in] - checksum of the block before sliding
+ * @param const uint8_t[in] - byte leaving the block
+ * @param const uint8_t[in] - byte entering the block
+ * @param const size_t[in] - size of the block in bytes
+ * @param uint32_t[out] - checksum of the block after sliding
+ */
+uint32_t weak_roll(const uint32_t sum, const uint8_t out, const uint8_t in, const size_t len);
+
+/***
+ * Computes the strong checksum of a block
+ * @param const uint8_t *[in] - block
+ * @param const size_t[in] - size of the block in bytes
+ * @param uint64_t[out] - strong checksum
+ */
+uint64_t strong_sum(const uint8_t *buf, const size_t len);
+
+/***
+ * Indexes the signatures of the receiver's blocks, so that they can be matched
+ * @param const struct signature *[in] - signatures, kept in use until delta_free
+ * @param const uint32_t[in] - number of signatures
+ * @param int[out] - 0 if no errors occur, negative value otherwise
+ */
+int delta_index(const struct signature *sigs, const uint32_t n);
+
+/***
+ * Looks for a block of the receiver's copy equal to the given one
+ * @param const uint32_t[in] - rolling checksum of the block
+ * @param const uint8_t *[in] - block
+ * @param const size_t[in] - size of the block in bytes
+ * @param int64_t[out] - index of the matching block, negative value if there is none
+ */
+int64_t delta_match(const uint32_t weak, const uint8_t *buf, const size_t len);
+
+/***
+ * Releases the index built by delta_index
+ */
+void delta_free(void);
+
+#endif /* _DELTA_H_ */
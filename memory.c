@@ -0,0 +1,250 @@
+/*
+ * memory.c
+ * Serial port protocol shared memory transport
+ * RC @ L.EIC 2122
+ * Authors: Miguel Rodrigues & Nuno Castro
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "transport.h"
+#include "utils.h"
+
+/* macros */
+#define RING_SIZE 65536 /* power of 2, so that the free running indexes wrap around cleanly */
+#define RING_MAGIC 0x52494e47
+#define OPEN_TRIES (TOUT * 10) /* 100 ms apart, the other end may not have created it yet */
+
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/* One direction of the channel, with a single writer and a single reader */
+struct ring {
+        uint32_t head, tail; /* bytes ever written and read, each only moved by its own end */
+        sem_t data, room; /* posted by the writer and by the reader after moving */
+        uint8_t buf[RING_SIZE];
+};
+
+struct shared {
+        uint32_t magic; /* set once the rings are ready to be used, cleared once left behind */
+        pid_t pid; /* of the end that created the channel */
+        struct ring ring[2]; /* the first one goes to the end that created the channel */
+};
+
+/* global variables */
+static struct shared *shared;
+static struct ring *rx, *tx;
+static int owner;
+static char name[NAME_MAX];
+
+
+static struct shared *
+mem_map(int fd)
+{
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct shared))
+                return NULL;
+
+        struct shared *sh;
+        sh = mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        return (sh == MAP_FAILED) ? NULL : sh;
+}
+
+static int
+mem_ready(const struct shared *sh)
+{
+        /* a channel left by an end that died may still look ready */
+        return LOAD(&sh->magic) == RING_MAGIC && (kill(sh->pid, 0) == 0 || errno == EPERM);
+}
+
+static int
+mem_create(const char *path)
+{
+        int fd;
+
+        /* left behind by an earlier run, and maybe already found by the other end */
+        fd = shm_open(path, O_RDWR, 0);
+        if (fd >= 0) {
+                shared = mem_map(fd);
+                if (shared != NULL) {
+                        STORE(&shared->magic, 0);
+                        munmap(shared, sizeof(struct shared));
+                }
+                close(fd);
+                shm_unlink(path);
+        }
+
+        fd = shm_open(path, O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+                return -1;
+        if (ftruncate(fd, sizeof(struct shared)) < 0 || (shared = mem_map(fd)) == NULL) {
+                close(fd);
+                shm_unlink(path);
+                return -1;
+        }
+
+        int i;
+        for (i = 0; i < 2; i++) {
+                sem_init(&shared->ring[i].data, 1, 0);
+                sem_init(&shared->ring[i].room, 1, 0);
+        }
+        shared->pid = getpid();
+        STORE(&shared->magic, RING_MAGIC);
+
+        return fd;
+}
+
+static int
+mem_attach(const char *path)
+{
+        int fd, i;
+
+        for (i = 0; i < OPEN_TRIES; i++) {
+                fd = shm_open(path, O_RDWR, 0);
+                if (fd >= 0 && (shared = mem_map(fd)) != NULL) {
+                        if (mem_ready(shared))
+                                return fd;
+                        munmap(shared, sizeof(struct shared));
+                }
+
+                if (fd >= 0)
+                        close(fd);
+                usleep(100000);
+        }
+
+        errno = ETIMEDOUT;
+        return -1;
+}
+
+static int
+mem_open(const char *path, const int server)
+{
+        int fd;
+        fd = server ? mem_create(path) : mem_attach(path);
+        if (fd < 0)
+                return -1;
+
+        rx = &shared->ring[server ? 0 : 1];
+        tx = &shared->ring[server ? 1 : 0];
+        owner = server;
+        snprintf(name, sizeof(name), "%s", path);
+        return fd;
+}
+
+static ssize_t
+mem_read(int fd, uint8_t *buf, const size_t len)
+{
+        uint32_t head, tail = rx->tail, n, i;
+
+        while ((head = LOAD(&rx->head)) == tail)
+                if (sem_wait(&rx->data) < 0)
+                        return -1;
+
+        n = head - tail;
+        if (n > len)
+                n = len;
+
+        for (i = 0; i < n; i++)
+                buf[i] = rx->buf[(tail + i) % RING_SIZE];
+
+        STORE(&rx->tail, tail + n);
+        sem_post(&rx->room);
+        return n;
+}
+
+static ssize_t
+mem_write(int fd, const uint8_t *buf, const size_t len)
+{
+        /* the ring has a single writer, retransmissions from the handler must wait their turn */
+        sigset_t set, old;
+        sigemptyset(&set);
+        sigaddset(&set, SIGALRM);
+        sigprocmask(SIG_BLOCK, &set, &old);
+
+        uint32_t head = tx->head, n, i;
+        size_t done = 0;
+
+        while (done < len) {
+                n = RING_SIZE - (head - LOAD(&tx->tail));
+                if (n == 0) {
+                        sem_wait(&tx->room);
+                        continue;
+                }
+
+                if (n > len - done)
+                        n = len - done;
+
+                for (i = 0; i < n; i++)
+                        tx->buf[(head + i) % RING_SIZE] = buf[done + i];
+
+                head += n;
+                done += n;
+                STORE(&tx->head, head);
+                sem_post(&tx->data);
+        }
+
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return done;
+}
+
+static int
+mem_wait(int fd, const int ms)
+{
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += ms / 1000 + (until.tv_nsec + (ms % 1000) * 1000000L) / 1000000000L;
+        until.tv_nsec = (until.tv_nsec + (ms % 1000) * 1000000L) % 1000000000L;
+
+        /* a post may be left over from bytes already read, so the ring itself is checked */
+        while (LOAD(&rx->head) == rx->tail)
+                if (sem_timedwait(&rx->data, &until) < 0)
+                        return errno == ETIMEDOUT ? 0 : -1;
+
+        return 1;
+}
+
+static int
+mem_drain(int fd)
+{
+        return 0; /* the other end still reads what was written after this one leaves */
+}
+
+static int
+mem_close(int fd)
+{
+        int i;
+
+        /* the other end is done with the rings once the link is closed */
+        if (owner) {
+                STORE(&shared->magic, 0);
+                for (i = 0; i < 2; i++) {
+                        sem_destroy(&shared->ring[i].data);
+                        sem_destroy(&shared->ring[i].room);
+                }
+        }
+
+        munmap(shared, sizeof(struct shared));
+        close(fd);
+
+        if (owner)
+                shm_unlink(name);
+        return 0;
+}
+
+const struct transport memory_transport = {
+        .name = "mem",
+        .open = mem_open,
+        .read = mem_read,
+        .write = mem_write,
+        .wait = mem_wait,
+        .drain = mem_drain,
+        .configure = NULL,
+        .close = mem_close,
+};
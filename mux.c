@@ -0,0 +1,248 @@
+/*
+ * mux.c
+ * Serial port logical channel multiplexer
+ * RC @ L.EIC 2122
+ * Authors: Miguel Rodrigues & Nuno Castro
+ */
+
+#include "mux.h"
+
+/* macros */
+#define CTRL_CHANNEL 0
+#define MAX_CHUNCK_SIZE (MAX_PACKET_SIZE - 1)
+
+#define IS_VALID(ch) (ch > CTRL_CHANNEL && ch < MUX_CHANNELS && channels[ch].used)
+
+/* logical channels */
+struct channel {
+        uint8_t used, prio, weight;
+        uint8_t credit, consumed;
+
+        uint8_t tx[MUX_WINDOW][MAX_CHUNCK_SIZE];
+        ssize_t tx_len[MUX_WINDOW];
+        int tx_head, tx_count;
+
+        uint8_t rx[MUX_WINDOW][MAX_CHUNCK_SIZE];
+        ssize_t rx_len[MUX_WINDOW];
+        int rx_head, rx_count;
+};
+
+/* global variables */
+static struct channel channels[MUX_CHANNELS];
+static uint8_t last_channel, burst;
+
+/* util funcs */
+static int
+is_eligible(const uint8_t ch)
+{
+        return channels[ch].used && channels[ch].tx_count > 0 && channels[ch].credit > 0;
+}
+
+static int
+is_pending(void)
+{
+        int ch;
+        for (ch = 1; ch < MUX_CHANNELS; ch++)
+                if (channels[ch].tx_count > 0)
+                        return 1;
+
+        return 0;
+}
+
+
+
+int
+muxchannel(const uint8_t ch, const uint8_t prio, const uint8_t weight)
+{
+        if (ch == CTRL_CHANNEL || ch >= MUX_CHANNELS || weight == 0)
+                return -1;
+
+        memset(&channels[ch], 0, sizeof(struct channel));
+        channels[ch].used = 1;
+        channels[ch].prio = prio;
+        channels[ch].weight = weight;
+        channels[ch].credit = MUX_WINDOW;
+
+        return 0;
+}
+
+
+
+static int
+mux_schedule(void)
+{
+        int i, ch, best = -1;
+
+        /* round robin among the channels with the best priority */
+        for (i = 1; i <= MUX_CHANNELS; i++) {
+                ch = (last_channel + i) % MUX_CHANNELS;
+                if (!is_eligible(ch))
+                        continue;
+
+                if (best < 0 || channels[ch].prio < channels[best].prio)
+                        best = ch;
+        }
+
+        if (best < 0)
+                return -1;
+
+        /* the last channel keeps the link until it spends its weight */
+        if (is_eligible(last_channel) && burst < channels[last_channel].weight
+                        && channels[last_channel].prio <= channels[best].prio)
+                best = last_channel;
+
+        burst = (best == last_channel) ? burst + 1 : 1;
+        last_channel = best;
+        return best;
+}
+
+static int
+mux_grant(int fd, const uint8_t ch)
+{
+        uint8_t frame[3];
+
+        frame[0] = CTRL_CHANNEL;
+        frame[1] = ch;
+        frame[2] = channels[ch].consumed;
+
+        if (llwrite(fd, frame, sizeof(frame)) < 0)
+                return -1;
+#ifdef DEBUG
+        plog("granted %d credits on channel %d\n", channels[ch].consumed, ch);
+#endif
+        channels[ch].consumed = 0;
+        return 0;
+}
+
+static int
+mux_recv(int fd)
+{
+        uint8_t frame[MAX_PACKET_SIZE];
+        ssize_t len;
+
+        len = llread(fd, frame);
+        if (len < 1)
+                return -1;
+
+        if (frame[0] == CTRL_CHANNEL) {
+                if (len == 3 && IS_VALID(frame[1]))
+                        channels[frame[1]].credit += frame[2];
+                return 0;
+        }
+
+        /* its credits would never come back, stalling the channel on the other end for good */
+        if (!IS_VALID(frame[0])) {
+                perr("frame on channel %d, not configured at this end\n", frame[0]);
+                errno = EPROTO;
+                passert(0, "mux.c :: mux_recv", -1);
+        }
+
+        struct channel *c = &channels[frame[0]];
+        if (c->rx_count == MUX_WINDOW) {
+                perr("channel %d overrun, frame dropped\n", frame[0]);
+                return 0;
+        }
+
+        int slot = (c->rx_head + c->rx_count) % MUX_WINDOW;
+        memcpy(c->rx[slot], frame + 1, len - 1);
+        c->rx_len[slot] = len - 1;
+        c->rx_count++;
+
+        return 0;
+}
+
+static int
+mux_send(int fd)
+{
+        int ch;
+        ch = mux_schedule();
+        if (ch < 0) /* every channel with pending data is waiting for credits */
+                return is_pending() ? mux_recv(fd) : 0;
+
+        struct channel *c = &channels[ch];
+        uint8_t frame[MAX_PACKET_SIZE];
+
+        frame[0] = ch;
+        memcpy(frame + 1, c->tx[c->tx_head], c->tx_len[c->tx_head]);
+
+        if (llwrite(fd, frame, c->tx_len[c->tx_head] + 1) < 0)
+                return -1;
+
+        c->tx_head = (c->tx_head + 1) % MUX_WINDOW;
+        c->tx_count--;
+        c->credit--;
+
+        return 0;
+}
+
+
+
+ssize_t
+muxwrite(int fd, const uint8_t ch, uint8_t *buffer, ssize_t len)
+{
+        if (!IS_VALID(ch) || len < 0 || len > MAX_CHUNCK_SIZE)
+                return -1;
+
+        struct channel *c = &channels[ch];
+        while (c->tx_count == MUX_WINDOW)
+                if (mux_send(fd) < 0)
+                        return -1;
+
+        int slot = (c->tx_head + c->tx_count) % MUX_WINDOW;
+        memcpy(c->tx[slot], buffer, len);
+        c->tx_len[slot] = len;
+        c->tx_count++;
+
+        if (mux_send(fd) < 0)
+                return -1;
+
+        return len;
+}
+
+int
+muxflush(int fd)
+{
+        while (is_pending())
+                if (mux_send(fd) < 0)
+                        return -1;
+
+        return 0;
+}
+
+ssize_t
+muxread(int fd, uint8_t *ch, uint8_t *buffer)
+{
+        int i, best;
+
+        if (*ch != MUX_ANY && !IS_VALID(*ch))
+                return -1;
+
+        do {
+                best = -1;
+                for (i = 1; i < MUX_CHANNELS; i++) {
+                        if (!channels[i].used || channels[i].rx_count == 0)
+                                continue;
+                        if (*ch != MUX_ANY && *ch != i)
+                                continue;
+                        if (best < 0 || channels[i].prio < channels[best].prio)
+                                best = i;
+                }
+        } while (best < 0 && mux_recv(fd) == 0);
+
+        if (best < 0)
+                return -1;
+
+        struct channel *c = &channels[best];
+        ssize_t len = c->rx_len[c->rx_head];
+
+        memcpy(buffer, c->rx[c->rx_head], len);
+        c->rx_head = (c->rx_head + 1) % MUX_WINDOW;
+        c->rx_count--;
+
+        /* credits are given back in batches of half a window */
+        if (++c->consumed >= (MUX_WINDOW + 1) / 2 && mux_grant(fd, best) < 0)
+                return -1;
+
+        *ch = best;
+        return len;
+}
@@ -0,0 +1,62 @@
+/*
+ * mux.h
+ * Serial port logical channel multiplexer
+ * RC @ L.EIC 2122
+ * Authors: Miguel Rodrigues & Nuno Castro
+ */
+
+#ifndef _MUX_H_
+#define _MUX_H_
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+#define MUX_CHANNELS 8
+#define MUX_ANY 0xff
+
+/***
+ * Configures a logical channel, this must be done on both ends before using it
+ * A frame arriving on a channel not configured at this end ends the process
+ * Channel 0 is reserved for the multiplexer's own flow control messages
+ * @param const uint8_t[in] - channel identifier, between 1 and MUX_CHANNELS - 1
+ * @param const uint8_t[in] - priority of the channel, lower values are scheduled first
+ * @param const uint8_t[in] - weight, frames sent in a row before yielding to a channel with the same priority
+ * @param int[out] - 0 if no errors occur, negative value otherwise
+ */
+int
+muxchannel(const uint8_t ch, const uint8_t prio, const uint8_t weight);
+
+/***
+ * Queues a chunck of information on a logical channel and lets the scheduler send the next frame
+ * Blocks only while the channel's queue is full
+ * @param int[in] - file descriptor returned by llopen
+ * @param const uint8_t[in] - channel identifier
+ * @param uint8_t *[in] - information to be written
+ * @param ssize_t[in] - size in bytes of the chunck of information, at most MAX_PACKET_SIZE - 1
+ * @param ssize_t[out] - number of bytes queued, negative value otherwise
+ */
+ssize_t
+muxwrite(int fd, const uint8_t ch, uint8_t *buffer, ssize_t len);
+
+/***
+ * Sends every chunck of information still queued on any logical channel
+ * @param int[in] - file descriptor returned by llopen
+ * @param int[out] - 0 if no errors occur, negative value otherwise
+ */
+int
+muxflush(int fd);
+
+/***
+ * Reads a chunck of information from a logical channel
+ * Information from the other channels is kept until it is asked for
+ * @param int[in] - file descriptor returned by llopen
+ * @param uint8_t *[in] - channel to read from, or MUX_ANY; set to the channel actually read
+ * @param uint8_t *[in] - place where to place the information after performing the reading
+ * @param ssize_t[out] - number of bytes read, negative value otherwise
+ */
+ssize_t
+muxread(int fd, uint8_t *ch, uint8_t *buffer);
+
+#endif /* _MUX_H_ */
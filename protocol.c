@@ -12,40 +12,124 @@
 #define ESCAPE 0x7D
 #define KEY 0x20
 
-#define RESEND 1
+#define FRAME_SIZE (2*(MAX_PACKET_SIZE+1)+5) /* worst case: every byte escaped */
+#define COBS_SIZE(n) ((n) + (n) / 254 + 2) /* n bytes, a code byte every 254 of them and the mark */
+#define COBS_MARK ESCAPE /* ends a field sent in COBS, a stuffed one never ends in ESCAPE */
+#define RX_QUEUE_LEN 8
+
+#define MAX_RTO (TOUT * 1000000L) /* microseconds */
+#define MIN_RTO 20000L
+
+#define PROBATION 1000 /* ms a new line rate is kept without hearing a valid frame */
+#define PROBE_COUNT 4
+#define PROBE_SIZE 64
+#define FALLBACK_WINDOW 32 /* attempts to send a frame between two checks of the line rate */
+#define FALLBACK_RATIO 25 /* percentage of them failed that makes the rate step down */
+
+#define SEQ_MOD 8
+#define ACK_EVERY ((WINDOW_SIZE + 1) / 2) /* frames received before acknowledging them at once */
+#define ACK_DELAY 10 /* ms an acknowledgement may wait for a frame to piggyback on */
+
+#if WINDOW_SIZE < 1 || WINDOW_SIZE >= SEQ_MOD
+#error "WINDOW_SIZE must be between 1 and 7"
+#endif
 
 #define IS_ESCAPE(c) (c == ESCAPE)
 #define IS_FLAG(c) (c == FLAG)
 #define ESCAPED_BYTE(c) (IS_ESCAPE(c) || IS_FLAG(c))
 
-#define BITSET(m, i) (m & (1 << i))
+/* information frames: N(S) on bits 1-3 and a piggybacked N(R) on bits 5-7 */
+#define IS_I_FRAME(c) ((c & 0x11) == 0x0)
+#define I_CTRL(ns, nr) ((ns) << 1 | (nr) << 5)
+#define I_NS(c) ((c >> 1) & 0x7)
+#define I_NR(c) ((c >> 5) & 0x7)
+
+/* supervision frames: N(R) on bits 5-7 as well */
+#define IS_S_CMD(cmd) (cmd == RR || cmd == REJ || cmd == RNR)
+#define S_NR(c) ((c >> 5) & 0x7)
+
+#define SEQ_DIST(from, to) (((to) - (from)) & (SEQ_MOD - 1))
+#define OUTSTANDING SEQ_DIST(send_base, next_seq)
 
 /* commands */ 
-typedef enum { SET, DISC, UA, RR_0, REJ_0, RR_1, REJ_1 } frameCmd;
-static const uint8_t cmds[7] = { 0x3, 0xb, 0x7, 0x5, 0x1, 0x85, 0x81 };
+typedef enum { SET, DISC, UA, RR, REJ, RNR, XID } frameCmd;
+static const uint8_t cmds[7] = { 0x3, 0xb, 0x7, 0x5, 0x1, 0x9, 0xaf };
 
 #ifdef DEBUG
-static const char cmds_str[7][6] = { "SET", "DISC", "UA", "RR_0", "REJ_0", "RR_1", "REJ_1" };
+static const char cmds_str[7][5] = { "SET", "DISC", "UA", "RR", "REJ", "RNR", "XID" };
 #endif
 
+/* line rate negotiation, carried in the information field of XID frames */
+typedef enum { PROPOSE, PROBE, COMMIT } xidType;
+
+/* options agreed on along with the rate, each end proposing only what it was built with */
+#define OPT_COBS 0x1
+#define LINK_OPTS (COBS ? OPT_COBS : 0)
+
+static const struct { speed_t code; long bps; } speeds[] = {
+        { B9600, 9600 }, { B19200, 19200 }, { B38400, 38400 }, { B57600, 57600 },
+        { B115200, 115200 }, { B230400, 230400 },
+#ifdef B921600
+        { B460800, 460800 }, { B921600, 921600 },
+#endif
+#ifdef B4000000
+        { B1000000, 1000000 }, { B1500000, 1500000 }, { B2000000, 2000000 },
+        { B3000000, 3000000 }, { B4000000, 4000000 },
+#endif
+};
+#define N_SPEEDS (int)(sizeof(speeds) / sizeof(speeds[0]))
+
 /* reading */
 typedef enum { START, FLAG_RCV, A_RCV, C_RCV, BCC_OK, DATA, STOP } readState;
 
+/* whether the peer has room for our frames, as far as its last RR or RNR tells */
+typedef enum { READY, BUSY, PROBED } peerState;
+
 /* global variables */
-static struct termios oldtio, newtio;
 static struct sigaction sigact;
 
+static const struct transport *tp;
 static int port_fd;
 
-static uint8_t connector;
-static volatile uint8_t retries, sequence_number = 0;
-static int connection_alive;
+static uint8_t connector, peer;
+static volatile uint8_t retries;
+static uint8_t send_base, next_seq, expected_number;
+static int connection_alive, ack_pending, rej_sent, rnr_sent, disc_received;
+static volatile peerState peer_state;
+static struct timespec ack_since, ack_sent_at;
+
+static volatile long rto = MAX_RTO;
+static volatile int rtt_valid;
+static long srtt, rttvar;
+static struct timespec sent_at;
+static uint8_t rtt_seq;
+
+static uint8_t tx_window[SEQ_MOD][FRAME_SIZE];
+static ssize_t tx_window_len[SEQ_MOD];
+
+static uint8_t in_buf[FRAME_SIZE];
+static ssize_t in_pos, in_len;
+
+static uint8_t rx_queue[RX_QUEUE_LEN][MAX_PACKET_SIZE];
+static ssize_t rx_queue_len[RX_QUEUE_LEN];
+static int rx_head, rx_count;
 
-static uint8_t buffer_frame[2*MAX_PACKET_SIZE+5];
-static ssize_t buffer_frame_len;
+static int cur_speed, prev_speed, max_speed;
+static int cobs; /* information fields sent in COBS rather than stuffed */
+static int probation, stat_sent, stat_resent;
+static volatile int probing;
+static struct timespec probation_since;
+
+static uint8_t xid_frame[FRAME_SIZE], xid_reply[FRAME_SIZE];
+static ssize_t xid_frame_len, xid_reply_len;
 
 /* forward declarations */
-static int check_resending(uint8_t cmd);
+void trmt_alrm_handler_write(int unused);
+static void send_ack(int fd);
+static void resend_window(void);
+static ssize_t encode_data(uint8_t **dest, const uint8_t *src, ssize_t len);
+static ssize_t decode_data(uint8_t *dest, const uint8_t *src, ssize_t len);
+static ssize_t decode_field(uint8_t *dest, const uint8_t *src, ssize_t len);
 
 /* util funcs */
 static void
@@ -57,52 +141,177 @@ install_sigalrm(void (*handler)(int))
         sigaction(SIGALRM, &sigact, NULL);
 }
 
+static int
+owns_timer(void)
+{
+        return sigact.sa_handler == trmt_alrm_handler_write;
+}
 
+static void
+block_alarm(const int block)
+{
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGALRM);
+        sigprocmask(block ? SIG_BLOCK : SIG_UNBLOCK, &set, NULL);
+}
 
-static int 
-term_conf_init(int port)
+static void
+start_timer(void)
 {
-        char fname[12];
-        snprintf(fname, 12, "/dev/ttyS%d", port);
+        struct itimerval it;
+        memset(&it, 0, sizeof(it));
 
-        port_fd = open(fname, O_RDWR | O_NOCTTY);
-        if (port_fd < 0)
-                return -1;
+        it.it_value.tv_sec = rto / 1000000L;
+        it.it_value.tv_usec = rto % 1000000L;
+        setitimer(ITIMER_REAL, &it, NULL);
+}
 
-        if (tcgetattr(port_fd, &oldtio) < 0)
-                return -1;
+static void
+stop_timer(void)
+{
+        struct itimerval it;
+        memset(&it, 0, sizeof(it));
+        setitimer(ITIMER_REAL, &it, NULL);
+}
 
-        memset(&newtio, '\0', sizeof(newtio));
+static int
+backoff_timer(void)
+{
+        int expired = rto == MAX_RTO;
 
-        newtio.c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
-        newtio.c_iflag = IGNPAR;
-        newtio.c_oflag = 0;
-        newtio.c_lflag = 0; /* set input mode (non-canonical, no echo...) */
+        rto = (2 * rto < MAX_RTO) ? 2 * rto : MAX_RTO;
+        rtt_valid = 0; /* Karn's rule: never sample a retransmitted frame */
+        start_timer();
 
-        newtio.c_cc[VTIME] = 0; 
-        newtio.c_cc[VMIN] = 1; /* 1 char required to satisfy a read */
+        return expired;
+}
 
-        tcflush(port_fd, TCIOFLUSH);
-        if (tcsetattr(port_fd, TCSANOW, &newtio) == -1)
-                return -1;
+static long
+elapsed_us(const struct timespec *since)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (now.tv_sec - since->tv_sec) * 1000000L + (now.tv_nsec - since->tv_nsec) / 1000L;
+}
+
+static void
+rtt_start(void)
+{
+        clock_gettime(CLOCK_MONOTONIC, &sent_at);
+        rtt_valid = 1;
+}
+
+static void
+rtt_sample(void)
+{
+        if (!rtt_valid)
+                return;
+
+        long r = elapsed_us(&sent_at);
+        if (srtt == 0) {
+                srtt = r;
+                rttvar = r / 2;
+        } else {
+                rttvar = (3 * rttvar + labs(srtt - r)) / 4;
+                srtt = (7 * srtt + r) / 8;
+        }
+
+        long nrto = srtt + 4 * rttvar;
+        rto = (nrto < MIN_RTO) ? MIN_RTO : (nrto > MAX_RTO) ? MAX_RTO : nrto;
+        rtt_valid = 0;
 #ifdef DEBUG
-        plog("termios struct set with success\n");
+        plog("rtt of %ld us, timeout set to %ld us\n", r, rto);
 #endif
-        return port_fd;
 }
 
+
+
 static int
-term_conf_end(int fd)
+speed_index(const speed_t code)
 {
-        if (tcsetattr(fd, TCSANOW, &oldtio) < 0)
+        int i;
+        for (i = 0; i < N_SPEEDS; i++)
+                if (speeds[i].code == code)
+                        return i;
+
+        return -1;
+}
+
+static int
+set_speed(int fd, const int idx)
+{
+        if (tp->configure == NULL || tp->configure(fd, speeds[idx].code) < 0)
                 return -1;
 
-        close(fd);
+        cur_speed = idx;
+        srtt = rttvar = 0; /* the round trip time changes along with the rate */
+#ifdef DEBUG
+        plog("line rate set to %ld bps\n", speeds[idx].bps);
+#endif
+        return 0;
+}
+
+static long
+time_left(const int active, const struct timespec *since, const long ms)
+{
+        if (!active)
+                return LONG_MAX;
+
+        long left = ms - elapsed_us(since) / 1000L;
+        return (left > 0) ? left : 0;
+}
+
+static int
+wait_input(int fd)
+{
+        long ack, prb;
+        int r;
+
+        while (ack_pending || probation) {
+                ack = time_left(ack_pending, &ack_since, ACK_DELAY);
+                prb = time_left(probation, &probation_since, PROBATION);
+
+                r = tp->wait(fd, (ack < prb) ? ack : prb);
+                if (r != 0)
+                        return r < 0 ? -1 : 0;
+
+                if (ack <= prb) {
+                        send_ack(fd); /* nothing came to piggyback it on */
+                } else {
+                        /* nothing got through at the new rate, the peer has gone back to the old one */
+                        probation = 0;
+                        set_speed(fd, prev_speed);
+                }
+        }
+
         return 0;
 }
 
 
 
+static int
+speed_init(int fd)
+{
+        /* the link always starts at BAUDRATE, faster rates are negotiated later */
+        cur_speed = prev_speed = max_speed = speed_index(BAUDRATE);
+        if (cur_speed < 0)
+                return -1;
+        if (tp->configure == NULL)
+                return 0; /* the channel has no line rate to negotiate */
+
+        max_speed = speed_index(MAX_BAUDRATE);
+        while (max_speed > cur_speed && tp->configure(fd, speeds[max_speed].code) < 0)
+                max_speed--;
+        if (max_speed < cur_speed)
+                max_speed = cur_speed;
+
+        return tp->configure(fd, speeds[cur_speed].code);
+}
+
+
+
 static int
 send_frame_us(int fd, const uint8_t cmd, const uint8_t addr)
 {        
@@ -110,10 +319,10 @@ send_frame_us(int fd, const uint8_t cmd, const uint8_t addr)
 
         frame[0] = frame[4] = FLAG;
         frame[1] = addr;
-        frame[2] = cmds[cmd];
+        frame[2] = cmds[cmd] | (IS_S_CMD(cmd) ? expected_number << 5 : 0);
         frame[3] = frame[1] ^ frame[2];
 
-        if (write(fd, frame, sizeof(frame)) < 0)
+        if (tp->write(fd, frame, sizeof(frame)) < 0)
                 return -1;
 #ifdef DEBUG
         if (addr == TRANSMITTER)
@@ -124,45 +333,104 @@ send_frame_us(int fd, const uint8_t cmd, const uint8_t addr)
         return 0;
 }
 
+static int
+send_frame_xid(int fd, const uint8_t *info, const ssize_t len)
+{
+        uint8_t *data = NULL;
+        ssize_t dlen = encode_data(&data, info, len);
+
+        xid_frame[0] = xid_frame[dlen+4] = FLAG;
+        xid_frame[1] = connector;
+        xid_frame[2] = cmds[XID];
+        xid_frame[3] = xid_frame[1] ^ xid_frame[2];
+        memcpy(xid_frame + 4, data, dlen);
+        xid_frame_len = dlen + 5;
+
+        free(data);
+        return tp->write(fd, xid_frame, xid_frame_len) < 0 ? -1 : 0;
+}
+
+static int
+frame_cmd(const uint8_t c)
+{
+        int i;
+        for (i = 0; i < sizeof(cmds); i++)
+                if (c == cmds[i] || (IS_S_CMD(i) && (c & 0x1f) == cmds[i]))
+                        return i;
+
+        return -1;
+}
+
 static int 
-read_frame_us(int fd, const uint8_t cmd_mask, const uint8_t addr)
+is_cmd(const uint8_t c)
+{
+        return IS_I_FRAME(c) || frame_cmd(c) >= 0;
+}
+
+static ssize_t
+read_byte(int fd, uint8_t *c)
+{
+        /* input is read in chunks, waiting for the ack or probation deadlines once per chunk */
+        if (in_pos == in_len) {
+                ssize_t rb = wait_input(fd);
+                if (rb == 0)
+                        rb = tp->read(fd, in_buf, sizeof(in_buf));
+                if (rb <= 0)
+                        return rb;
+
+                in_pos = 0;
+                in_len = rb;
+        }
+
+        *c = in_buf[in_pos++];
+        return 1;
+}
+
+static ssize_t
+read_frame(int fd, uint8_t *frame)
 {
         readState st = START;
-        uint8_t frame[5];
-        ssize_t i, cmd, rb;
+        ssize_t c = 0, rb;
 
-        while (st != STOP && retries < MAX_RETRIES) {
-                rb = read(fd, frame + st, 1);
-                if (rb < 0 && errno == EINTR)
+        while (st != STOP) {
+                rb = read_byte(fd, frame + st + c);
+                if (rb < 0 && errno == EINTR && retries < MAX_RETRIES)
                         continue;
 
+                if (rb <= 0) {
+                        if (rb == 0 || errno != EINTR) { /* end of file or a broken channel */
+                                connection_alive = 0;
+                                errno = ENOTCONN;
+                        } else {
+                                errno = ETIMEDOUT; /* no answer after MAX_RETRIES */
+                        }
+                        return -1;
+                }
+
                 switch (st) {
                 case START:
                         st = IS_FLAG(frame[st]) ? FLAG_RCV : START;
                         break;
                 case FLAG_RCV:
-                        if (frame[st] == addr)
-                                    st = A_RCV;
-                        else if (frame[st] != FLAG)
+                        if (frame[st] == peer)
+                                st = A_RCV;
+                        else if (!IS_FLAG(frame[st]))
                                 st = START;
                         break;
                 case A_RCV:
-                        for (i = 0; i < 7; i++) {
-                                if (BITSET(cmd_mask, i) && frame[st] == cmds[i]) {
-                                        st = C_RCV;
-                                        cmd = i;
-                                }
-                        }
-
-                        if (st != C_RCV) {
-                                st = IS_FLAG(frame[st]) ? FLAG_RCV : START;
+                        if (is_cmd(frame[st])) {
+                                st = C_RCV;
+                        } else if (IS_FLAG(frame[st])) {
+                                st = FLAG_RCV;
                                 frame[0] = FLAG;
+                        } else {
+                                st = START;
                         }
                         break;
                 case C_RCV:
                         if (frame[st] == (frame[st-1] ^ frame[st-2])) {
                                 st = BCC_OK;
-                        } else if (frame[st] == FLAG) {
+                        } else if (IS_FLAG(frame[st])) {
                                 st = FLAG_RCV;
                                 frame[0] = FLAG;
                         } else {
@@ -170,46 +438,401 @@ read_frame_us(int fd, const uint8_t cmd_mask, const uint8_t addr)
                         }
                         break;
                 case BCC_OK:
-                        st = IS_FLAG(frame[st]) ? STOP : START;
+                        st = IS_FLAG(frame[st]) ? STOP : DATA;
+                        break;
+                case DATA:
+                        st = IS_FLAG(frame[st+c]) ? STOP : DATA;
+                        c++;
+                        if (st != STOP && DATA + c >= FRAME_SIZE) {
+                                st = START; /* too long to be a frame */
+                                c = 0;
+                        }
                         break;
                 default:
                         break;
                 }
         }
 
-        connection_alive = retries < MAX_RETRIES;
-        if (!connection_alive)
+        return c + 5;
+}
+
+
+
+static void
+send_ack(int fd)
+{
+        if (!ack_pending)
+                return;
+
+        send_frame_us(fd, RR, connector);
+        clock_gettime(CLOCK_MONOTONIC, &ack_sent_at);
+        ack_pending = 0;
+}
+
+static void
+queue_ack(int fd)
+{
+        if (ack_pending++ == 0)
+                clock_gettime(CLOCK_MONOTONIC, &ack_since);
+
+        if (ack_pending >= ACK_EVERY)
+                send_ack(fd);
+}
+
+static void
+recv_ack(const uint8_t nr)
+{
+        uint8_t acked = SEQ_DIST(send_base, nr);
+        if (acked == 0 || acked > OUTSTANDING)
+                return;
+
+        /* a single acknowledgement may cover several frames */
+        if (owns_timer() && rtt_valid && SEQ_DIST(send_base, rtt_seq) < acked)
+                rtt_sample();
+        send_base = nr;
+        retries = 0;
+
+        if (!owns_timer()) /* a negotiation is using the timer */
+                return;
+        if (OUTSTANDING)
+                start_timer();
+        else
+                stop_timer();
+}
+
+static void
+recv_rr(const uint8_t nr)
+{
+        int busy = peer_state != READY;
+        peer_state = READY;
+        recv_ack(nr);
+        if (!busy || !OUTSTANDING || !owns_timer())
+                return;
+
+        /* the frames it had no room for are sent again, not counting as a go back */
+        rtt_valid = 0;
+        start_timer();
+        resend_window();
+}
+
+static void
+recv_rnr(const uint8_t nr)
+{
+        recv_ack(nr);
+
+        /* alive but out of room, the window waits for its RR without using up retries */
+        peer_state = BUSY;
+        retries = 0;
+}
+
+static void
+recv_rej(const uint8_t nr)
+{
+        recv_ack(nr);
+        if (!OUTSTANDING || nr != send_base || !owns_timer())
+                return;
+
+        /* go back N: every frame from the rejected one onwards is resent */
+        rtt_valid = 0;
+        stat_resent++;
+        start_timer();
+        resend_window();
+}
+
+static void
+recv_xid(int fd, const uint8_t *frame, const ssize_t len)
+{
+        uint8_t info[FRAME_SIZE];
+        ssize_t i, dlen;
+        dlen = decode_data(info, frame + 4, len - 5);
+
+        uint8_t bcc = 0;
+        for (i = 0; i < dlen - 1; i++)
+                bcc ^= info[i];
+        if (dlen < 3 || bcc != info[dlen-1] || info[1] >= N_SPEEDS)
+                return;
+
+        if (connector == TRANSMITTER) { /* the answer to one of our own */
+                memcpy(xid_reply, info, dlen - 1);
+                xid_reply_len = dlen - 1;
+                return;
+        }
+
+        /* the RECEIVER echoes every XID, settling for its own limit on proposals */
+        if (info[0] == PROPOSE && info[1] > max_speed)
+                info[1] = max_speed;
+        if (info[0] == PROPOSE && dlen > 3) { /* and for the options both ends want */
+                info[2] &= LINK_OPTS;
+                cobs = info[2] & OPT_COBS;
+        }
+        send_frame_xid(fd, info, dlen - 1);
+
+        if (info[0] == COMMIT) {
+                probation = 0;
+        } else if (info[0] == PROPOSE && info[1] != cur_speed) {
+                if (!probation)
+                        prev_speed = cur_speed;
+                set_speed(fd, info[1]);
+                probation = 1;
+                clock_gettime(CLOCK_MONOTONIC, &probation_since);
+        }
+}
+
+static void
+reject_data(int fd, const int damaged)
+{
+        /* one REJ per gap, unless the frame expected is the one damaged */
+        if (rej_sent && !damaged) {
+                queue_ack(fd); /* in case our acknowledgement got lost */
+                return;
+        }
+
+        send_frame_us(fd, REJ, connector);
+        rej_sent = 1;
+        ack_pending = 0;
+}
+
+static void
+recv_data(int fd, const uint8_t *frame, const ssize_t len)
+{
+        uint8_t data[FRAME_SIZE];
+        ssize_t i, dlen;
+
+        if (rx_count == RX_QUEUE_LEN) {
+                /* no room left, answering only the frame expected so that a window gets one RNR */
+                if (I_NS(frame[2]) == expected_number) {
+                        send_frame_us(fd, RNR, connector);
+                        rnr_sent = 1;
+                        ack_pending = 0;
+                }
+                return;
+        }
+
+        if (I_NS(frame[2]) != expected_number) {
+#ifdef DEBUG
+                plog("frame no. %d out of sequence discarded\n", I_NS(frame[2]));
+#endif
+                reject_data(fd, 0);
+                return;
+        }
+
+        dlen = decode_field(data, frame + 4, len - 5);
+
+        uint8_t bcc = 0;
+        for (i = 0; i < dlen - 1; i++)
+                bcc ^= data[i];
+#ifdef DEBUG
+        bcc ^= (rand() % 100 < FER) ? 0xff : 0x0; /* artificial error on bcc */
+        sleep(TPROP); /* artificial propagation time */
+#endif
+        if (dlen < 2 || dlen > MAX_PACKET_SIZE + 1 || bcc != data[dlen-1]) {
+                reject_data(fd, 1);
+                return;
+        }
+
+        int slot = (rx_head + rx_count) % RX_QUEUE_LEN;
+        memcpy(rx_queue[slot], data, dlen - 1);
+        rx_queue_len[slot] = dlen - 1;
+        rx_count++;
+
+        expected_number = (expected_number + 1) % SEQ_MOD;
+        rej_sent = 0;
+        queue_ack(fd);
+#ifdef DEBUG
+        plog("frame no. %d read with %ld bytes\n", I_NS(frame[2]), len);
+#endif
+}
+
+static int
+handle_frame(int fd, const uint8_t *frame, const ssize_t len)
+{
+        if (probation) /* the new rate works as long as frames keep coming */
+                clock_gettime(CLOCK_MONOTONIC, &probation_since);
+
+        /* the retransmission handler shares the window with the code below */
+        block_alarm(1);
+        if (IS_I_FRAME(frame[2])) {
+                recv_ack(I_NR(frame[2]));
+                recv_data(fd, frame, len);
+                block_alarm(0);
                 return -1;
+        }
+
+        int cmd;
+        cmd = frame_cmd(frame[2]);
 #ifdef DEBUG
-        if (addr == RECEIVER)
+        if (peer == TRANSMITTER)
                 plog("frame read with %s @ TRANSMITTER\n", cmds_str[cmd]);
-        else if (addr == TRANSMITTER)
+        else if (peer == RECEIVER)
                 plog("frame read with %s @ RECEIVER\n", cmds_str[cmd]);
 #endif
-        uint8_t frame_i_ans = 1 << RR_0 | 1 << REJ_0 | 1 << RR_1 | 1 << REJ_1;
-        if (connector == TRANSMITTER && cmd_mask == frame_i_ans)
-                return check_resending(frame[2]);
+        switch (cmd) {
+        case SET:
+                if (connector == RECEIVER)
+                        send_frame_us(fd, UA, RECEIVER);
+                break;
+        case DISC:
+                /* a side that only received has no sample, but the peer closes once our last ack gets there */
+                if (srtt == 0 && !rtt_valid && ack_sent_at.tv_sec != 0) {
+                        sent_at = ack_sent_at;
+                        rtt_valid = 1;
+                        rtt_sample();
+                }
+                disc_received = 1;
+                break;
+        case RR:
+                recv_rr(S_NR(frame[2]));
+                break;
+        case RNR:
+                recv_rnr(S_NR(frame[2]));
+                break;
+        case REJ:
+                recv_rej(S_NR(frame[2]));
+                break;
+        case XID:
+                recv_xid(fd, frame, len);
+                break;
+        default:
+                break;
+        }
+        block_alarm(0);
 
+        return cmd;
+}
+
+static int
+wait_frame_us(int fd, const uint8_t cmd)
+{
+        uint8_t frame[FRAME_SIZE];
+        ssize_t len;
+
+        do {
+                len = read_frame(fd, frame);
+        } while (len >= 0 && handle_frame(fd, frame, len) != cmd);
+
+        connection_alive = len >= 0;
+        return connection_alive ? 0 : -1;
+}
+
+
+
+void
+trmt_alrm_handler_xid(int unused)
+{
+        int expired = backoff_timer();
+        retries += probing ? 1 : expired; /* a probe lost is a failed error test */
+        tp->write(port_fd, xid_frame, xid_frame_len);
+}
+
+static int
+xid_match(const uint8_t *info, const ssize_t len)
+{
+        if (xid_reply_len == 0 || xid_reply[0] != info[0])
+                return 0;
+
+        /* proposals may be lowered, anything else must come back untouched */
+        return info[0] == PROPOSE || (xid_reply_len == len && memcmp(xid_reply, info, len) == 0);
+}
+
+static int
+xid_exchange(int fd, const uint8_t *info, const ssize_t len)
+{
+        uint8_t frame[FRAME_SIZE];
+        ssize_t flen = 0;
+
+        xid_reply_len = 0;
+        install_sigalrm(trmt_alrm_handler_xid);
+        if (send_frame_xid(fd, info, len) < 0)
+                return -1;
+
+        rtt_start();
+        start_timer();
+        while (!xid_match(info, len)) {
+                flen = read_frame(fd, frame);
+                if (flen < 0)
+                        break;
+
+                handle_frame(fd, frame, flen);
+        }
+        stop_timer();
+
+        if (flen < 0)
+                return -1;
+
+        rtt_sample();
         return 0;
 }
 
+static int
+switch_speed(int fd, const int idx)
+{
+        uint8_t info[3 + PROBE_SIZE];
+        int i, old = cur_speed;
+
+        if (set_speed(fd, idx) < 0)
+                return -1;
+
+        /* probes are filled with the bytes that need stuffing as well */
+        info[0] = PROBE;
+        info[1] = idx;
+        for (i = 0; i < PROBE_SIZE; i++)
+                info[3+i] = FLAG ^ (i * 37);
+
+        retries = 0;
+        probing = 1;
+        for (i = 0; i < PROBE_COUNT; i++) {
+                info[2] = i;
+                if (xid_exchange(fd, info, sizeof(info)) < 0)
+                        break;
+        }
+        probing = 0;
+
+        if (i == PROBE_COUNT) {
+                info[0] = COMMIT;
+                retries = 0;
+                if (xid_exchange(fd, info, 2) == 0)
+                        return 0;
+        }
+
+        /* the RECEIVER goes back on its own once it stops hearing from us */
+        set_speed(fd, old);
+        return -1;
+}
+
+static void
+negotiate_speed(int fd, int idx, const int lowest)
+{
+        uint8_t info[3];
+
+        for (; idx >= lowest; idx--) {
+                info[0] = PROPOSE;
+                info[1] = idx;
+                info[2] = LINK_OPTS;
+                retries = 0;
+                if (xid_exchange(fd, info, sizeof(info)) < 0)
+                        return;
+
+                cobs = xid_reply_len > 2 && (xid_reply[2] & OPT_COBS);
+
+                idx = xid_reply[1]; /* the fastest rate both ends support */
+                if (idx == cur_speed || switch_speed(fd, idx) == 0)
+                        return;
+        }
+}
+
 
 
 void 
 trmt_alrm_handler_open(int unused) 
 {
-        alarm(TOUT);
-        retries++;
+        retries += backoff_timer();
         send_frame_us(port_fd, SET, TRANSMITTER);
 }
 
 static int 
 llopen_recv(int fd)
 {
-        read_frame_us(fd, 1 << SET, TRANSMITTER);
-        send_frame_us(fd, UA, RECEIVER);
-        
-        return 0;
+        return wait_frame_us(fd, SET);
 }
 
 static int 
@@ -221,32 +844,62 @@ llopen_trmt(int fd)
         install_sigalrm(trmt_alrm_handler_open);
 
         send_frame_us(fd, SET, TRANSMITTER);
-        alarm(TOUT);
-        conn_est = read_frame_us(fd, 1 << UA, RECEIVER);
-        alarm(0);
+        rtt_start();
+        start_timer();
+        conn_est = wait_frame_us(fd, UA);
+        stop_timer();
+        if (connection_alive)
+                rtt_sample();
 
         if (!connection_alive) {
                 perr("can't establish a connection with the RECEIVER\n");
                 return -1;
         }
 
+        /* the current rate is proposed last, so that the options are agreed on regardless */
+        negotiate_speed(fd, max_speed, cur_speed);
         return conn_est;
 }
 
 int 
-llopen(int port, const uint8_t addr)
+llopen(const char *port, const uint8_t addr)
 {
+        const char *path;
+        tp = transport_find(port, &path);
+        if (tp == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
         int fd;
-        fd = term_conf_init(port);
+        fd = tp->open(path, addr == RECEIVER);
         if (fd < 0)
                 return -1;
+
+        port_fd = fd;
+        if (speed_init(fd) < 0) {
+                tp->close(fd);
+                return -1;
+        }
         
+        connector = addr;
+        peer = (addr == TRANSMITTER) ? RECEIVER : TRANSMITTER;
+        send_base = next_seq = expected_number = 0;
+        ack_pending = rej_sent = rnr_sent = disc_received = 0;
+        peer_state = READY;
+        rx_head = rx_count = 0;
+        in_pos = in_len = 0;
+        memset(&ack_sent_at, 0, sizeof(ack_sent_at));
+        rto = MAX_RTO;
+        srtt = rttvar = 0;
+        probation = stat_sent = stat_resent = 0;
+        cobs = 0;
+
         int cnct;
         cnct = (addr == TRANSMITTER) ? llopen_trmt(fd) : llopen_recv(fd);
         if (cnct < 0)
                 return cnct;
 
-        connector = addr;
         return fd;
 }
 
@@ -300,178 +953,256 @@ decode_data(uint8_t *dest, const uint8_t *src, ssize_t len)
         return len - dec;
 }
 
+static ssize_t
+encode_cobs(uint8_t **dest, const uint8_t *src, ssize_t len)
+{
+        uint8_t raw[len + 1];
+        ssize_t i, j, code_at;
+        memcpy(raw, src, len);
+        raw[len] = 0;
+        for (i = 0; i < len; i++)
+                raw[len] ^= src[i];
+
+        *dest = (uint8_t *)malloc(COBS_SIZE(len + 1));
+        passert(*dest != NULL, "protocol.c :: malloc", -1);
+
+        /* every zero becomes the distance to the next one, with one at least every 254 bytes */
+        uint8_t *out = *dest;
+        for (i = 0, j = 1, code_at = 0; i <= len; i++) {
+                if (raw[i] != 0)
+                        out[j++] = raw[i];
+                if (raw[i] == 0 || j - code_at == 0xff) {
+                        out[code_at] = j - code_at;
+                        code_at = j++;
+                }
+        }
+        out[code_at] = j - code_at;
+
+        /* with no zero left, no byte turns into a FLAG either */
+        for (i = 0; i < j; i++)
+                out[i] ^= FLAG;
+        out[j] = COBS_MARK;
+
+        return j + 1;
+}
+
+static ssize_t
+decode_cobs(uint8_t *dest, const uint8_t *src, ssize_t len)
+{
+        ssize_t i = 0, j = 0, k;
+        uint8_t code;
+
+        for (len--; i < len; ) {
+                code = src[i++] ^ FLAG;
+                if (code == 0 || i + code - 1 > len)
+                        return -1; /* damaged, points past the end */
+
+                for (k = 1; k < code; k++)
+                        dest[j++] = src[i++] ^ FLAG;
+                if (code != 0xff && i < len)
+                        dest[j++] = 0;
+        }
 
+        return j;
+}
 
 static ssize_t
-trmt_send_data(void)
+decode_field(uint8_t *dest, const uint8_t *src, ssize_t len)
 {
+        if (len > 0 && src[len-1] == COBS_MARK)
+                return decode_cobs(dest, src, len);
+
+        return decode_data(dest, src, len);
+}
+
+
+
+static ssize_t
+trmt_send_data(const uint8_t seq)
+{
+        uint8_t *frame = tx_window[seq];
+
+        /* refresh the piggybacked acknowledgement on every (re)transmission */
+        frame[2] = I_CTRL(seq, expected_number);
+        frame[3] = frame[1] ^ frame[2];
+        ack_pending = 0;
+
         ssize_t wb;
-        wb = write(port_fd, buffer_frame, buffer_frame_len);
+        wb = tp->write(port_fd, frame, tx_window_len[seq]);
 #ifdef DEBUG
-        uint8_t sn = sequence_number;
-        plog("sent frame no. %d of %ld bytes\n", sn, wb);
-        plog("waiting on response from RECEIVER for frame no. %d\n", sn);
+        plog("sent frame no. %d of %ld bytes\n", seq, wb);
 #endif
         return wb;
 }
 
+static void
+resend_window(void)
+{
+        uint8_t seq;
+        for (seq = send_base; seq != next_seq; seq = (seq + 1) % SEQ_MOD)
+                trmt_send_data(seq);
+}
+
 void
 trmt_alrm_handler_write(int unused) 
 {
-        alarm(TOUT);
-        ++retries;
-        trmt_send_data();
+        /* expired while blocked, but the ack that emptied the window got in first */
+        if (!OUTSTANDING)
+                return;
+
+        if (peer_state == BUSY) { /* probed with the oldest frame, until it answers RR */
+                peer_state = PROBED;
+                backoff_timer();
+                trmt_send_data(send_base);
+                return;
+        }
+
+        retries += backoff_timer(); /* only give up once backed off to TOUT */
+        stat_resent++;
+        resend_window();
 }
 
-static int 
-check_resending(const uint8_t cmd)
+static void
+check_line_rate(int fd)
 {
-        sequence_number = (cmd == cmds[RR_1] || cmd == cmds[REJ_0]);
-        return (cmd == cmds[REJ_0] || cmd == cmds[REJ_1]);
+        /* every new frame and every go back counts as an attempt */
+        int attempts = stat_sent + stat_resent;
+        if (connector != TRANSMITTER || attempts < FALLBACK_WINDOW)
+                return;
+
+        int fallback = tp->configure != NULL && cur_speed > 0 && 100 * stat_resent > FALLBACK_RATIO * attempts;
+        stat_sent = stat_resent = 0;
+        if (!fallback)
+                return;
+#ifdef DEBUG
+        plog("too many frames resent, lowering the line rate\n");
+#endif
+        stop_timer();
+        negotiate_speed(fd, cur_speed - 1, 0);
+        if (!OUTSTANDING) /* acknowledged while negotiating */
+                return;
+
+        block_alarm(1);
+        retries = 0;
+        rtt_valid = 0;
+        install_sigalrm(trmt_alrm_handler_write);
+        start_timer();
+        resend_window();
+        block_alarm(0);
+}
+
+static int
+wait_window(int fd, const int room)
+{
+        uint8_t frame[FRAME_SIZE];
+        ssize_t flen;
+
+        if (!connection_alive) {
+                errno = ENOTCONN;
+                return -1;
+        }
+
+        while (OUTSTANDING > room) {
+                flen = read_frame(fd, frame);
+                if (flen < 0)
+                        break;
+
+                handle_frame(fd, frame, flen);
+                check_line_rate(fd);
+        }
+
+        connection_alive = OUTSTANDING <= room;
+        if (!connection_alive) {
+                int err = errno;
+                perr("can't establish a connection with the other end\n");
+                errno = err;
+                return -1;
+        }
+
+        return 0;
 }
 
 ssize_t
 llwrite(int fd, uint8_t *buffer, ssize_t len)
 {
+        if (wait_window(fd, WINDOW_SIZE - 1) < 0)
+                return -1;
+
         uint8_t *data = NULL;
-        len = encode_data(&data, buffer, len);
+        len = cobs ? encode_cobs(&data, buffer, len) : encode_data(&data, buffer, len);
         if (len < 0)
                 return len;
 
-        uint8_t frame[len+5];
-
-        frame[0] = frame[len+4] = FLAG;
-        frame[1] = TRANSMITTER;
-        frame[2] = sequence_number << 6;
-        frame[3] = frame[1] ^ frame[2];
-        memcpy(frame + 4, data, len);
+        uint8_t seq = next_seq;
+        tx_window[seq][0] = tx_window[seq][len+4] = FLAG;
+        tx_window[seq][1] = connector;
+        memcpy(tx_window[seq] + 4, data, len);
+        tx_window_len[seq] = len + 5;
 
         free(data);
 
-        buffer_frame_len = sizeof(frame);
-        memcpy(buffer_frame, frame, buffer_frame_len);
-
-        retries = 0;
-        install_sigalrm(trmt_alrm_handler_write);
+        block_alarm(1);
+        next_seq = (seq + 1) % SEQ_MOD;
+        stat_sent++;
+        if (OUTSTANDING == 1) { /* the timer always runs for the oldest frame */
+                retries = 0;
+                install_sigalrm(trmt_alrm_handler_write);
+                start_timer();
+        }
+        if (!rtt_valid) { /* one frame of the window is timed at a time */
+                rtt_start();
+                rtt_seq = seq;
+        }
 
         ssize_t wb;
-        int rsnd;
-        uint8_t mask = 1 << RR_0 | 1 << REJ_0 | 1 << RR_1 | 1 << REJ_1;
-
-        do {
-                wb = trmt_send_data();
-                if (wb < 0)
-                        return wb;
-
-                alarm(TOUT);
-                rsnd = read_frame_us(fd, mask, RECEIVER);
-                alarm(0);
-        } while (connection_alive && rsnd == RESEND);
-
-        if (!connection_alive) {
-                perr("can't establish a connection with RECEIVER\n");
-                return -1;
-        }
+        wb = trmt_send_data(seq);
+        block_alarm(0);
 
         return wb;
 }
 
 
 
-static int 
-recv_send_response(int fd, const uint8_t *buffer, const ssize_t len) 
-{
-        ssize_t i;
-        uint8_t bcc = buffer[0], expect_bcc = buffer[len-1];
-        for (i = 1; i < len - 1; i++)
-                bcc ^= buffer[i];
-#ifdef DEBUG
-        bcc ^= (rand() % 100 < FER) ? 0xff : 0x0; /* artificial error on bcc */
-        sleep(TPROP); /* artificial propagation time */
-#endif  
-        uint8_t cmd;
-        cmd = sequence_number ? RR_1 : RR_0;
-        if (bcc != expect_bcc)
-                cmd = sequence_number ? REJ_1 : REJ_0;
-
-        send_frame_us(fd, cmd, RECEIVER);
-        return (bcc == expect_bcc) ? len : -1;
-}
-
 ssize_t
 llread(int fd, uint8_t *buffer)
 {
-        readState st = START;
-        uint8_t frame[2*MAX_PACKET_SIZE+5];
-        uint8_t disc = 0;
-        ssize_t c = 0;
+        uint8_t frame[FRAME_SIZE];
+        ssize_t len;
 
-        while (st != STOP) {
-                if (read(fd, frame + st + c, 1) < 0)
-                        return -1;
+        if (!connection_alive) {
+                errno = ENOTCONN;
+                return -1;
+        }
 
-                switch (st) {
-                case START:
-                        st = IS_FLAG(frame[st]) ? FLAG_RCV : START;
-                        break;
-                case FLAG_RCV:
-                        if (frame[st] == TRANSMITTER)
-                                st = A_RCV;
-                        else if (frame[st] != FLAG)
-                                st = START;
-                        break;
-                case A_RCV:
-                        if (frame[st] == 0x0 || frame[st] == 0x40) {
-                                sequence_number = !frame[st];
-                                st = C_RCV;
-                        } else if (frame[st] == cmds[DISC]) {
-                                st = C_RCV;
-                                disc = 1;
-                        } else if (IS_FLAG(frame[st])) {
-                                st = FLAG_RCV;
-                                frame[0] = FLAG;
-                        } else {
-                                st = START;
-                        }
-                        break;
-                case C_RCV:
-                        if (frame[st] == (frame[st-1] ^ frame[st-2])) {
-                                st = BCC_OK;
-                        } else if (IS_FLAG(frame[st])) {
-                                st = FLAG_RCV;
-                                frame[0] = FLAG;
-                        } else {
-                                st = START;
-                        }
-                        break;
-                case BCC_OK:
-                        st = IS_FLAG(frame[st]) ? STOP : DATA; 
-                        break;
-                case DATA:
-                        st = IS_FLAG(frame[st+c]) ? STOP : DATA;
-                        c++;
-                        break;
-                default:
-                        break;
+        while (rx_count == 0 && !disc_received) {
+                len = read_frame(fd, frame);
+                if (len < 0) {
+                        if (errno == ETIMEDOUT) /* our frames went unacknowledged */
+                                connection_alive = 0;
+                        return -1;
                 }
-        }
 
-#ifdef DEBUG
-        uint8_t sn = sequence_number;
-        plog("frame no. %d read with %ld bytes\n", sn, c + 5);
-#endif
+                handle_frame(fd, frame, len);
+                check_line_rate(fd);
+        }
 
-        if (disc) {
+        if (rx_count == 0) {
 #ifdef DEBUG
                 plog("disconnect frame detected\n");
 #endif
-                send_frame_us(fd, DISC, RECEIVER);
+                send_frame_us(fd, DISC, connector);
                 return -1;
         }
 
-        ssize_t len;
-        len = decode_data(buffer, frame + 4, c);
-        len = recv_send_response(fd, buffer, len);
+        len = rx_queue_len[rx_head];
+        memcpy(buffer, rx_queue[rx_head], len);
+        rx_head = (rx_head + 1) % RX_QUEUE_LEN;
+        rx_count--;
+
+        if (rnr_sent && rx_count <= RX_QUEUE_LEN / 2) { /* room again for what the peer holds back */
+                send_frame_us(fd, RR, connector);
+                rnr_sent = 0;
+        }
 
         return len;
 }
@@ -481,33 +1212,64 @@ llread(int fd, uint8_t *buffer)
 void 
 trmt_alrm_handler_close(int unused) 
 {
-        alarm(TOUT);
+        backoff_timer();
         retries++;
-        send_frame_us(port_fd, DISC, TRANSMITTER);
+        send_frame_us(port_fd, DISC, connector);
+}
+
+static int
+llclose_wait(int fd, const uint8_t cmd)
+{
+        uint8_t frame[FRAME_SIZE];
+        ssize_t len;
+        int rcmd = -1;
+
+        retries = 0;
+        install_sigalrm(trmt_alrm_handler_close);
+
+        if (cmd == DISC)
+                rtt_start();
+        start_timer();
+        do {
+                len = read_frame(fd, frame);
+                if (len < 0)
+                        break;
+
+                rcmd = handle_frame(fd, frame, len);
+                if (rcmd == DISC && cmd == UA) /* our DISC got lost */
+                        send_frame_us(fd, DISC, connector);
+        } while (rcmd != cmd);
+        stop_timer();
+
+        connection_alive = len >= 0;
+        if (connection_alive)
+                rtt_sample();
+
+        return connection_alive ? 0 : -1;
 }
 
 int
 llclose(int fd)
 {
-        if (connector == TRANSMITTER) {
-                retries = 0;
-                install_sigalrm(trmt_alrm_handler_close);
+        if (!disc_received) {
+                if (wait_window(fd, 0) < 0) /* every frame sent must be acknowledged first */
+                        return -1;
+
+                send_ack(fd);
+                send_frame_us(fd, DISC, connector);
             
-                send_frame_us(fd, DISC, TRANSMITTER);
-
-                alarm(TOUT);
-                read_frame_us(fd, 1 << DISC, RECEIVER);
-                alarm(0);
-                
-                if (!connection_alive) {
-                        perr("can't establish a connection with RECEIVER\n");
+                if (llclose_wait(fd, DISC) < 0) {
+                        perr("can't establish a connection with the other end\n");
                         return -1;
                 }
 
-                send_frame_us(fd, UA, TRANSMITTER);
+                send_frame_us(fd, UA, connector);
+        } else if (llclose_wait(fd, UA) < 0) {
+#ifdef DEBUG
+                plog("no UA frame on disconnection, closing anyway\n");
+#endif
         }
 
-        sleep(2); /* gives time to all the info flow through the communications channel */
-        return term_conf_end(fd);
+        tp->drain(fd); /* waits until every frame has left the output queue */
+        return tp->close(fd);
 }
-
@@ -10,14 +10,17 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "transport.h"
 #include "utils.h"
 
 #define RECEIVER 0x01
@@ -25,15 +28,20 @@
 
 /***
  * Sets up the terminal, in order to send information packets
- * @param int[in] - port x corresponding to the file /dev/ttySx
+ * Both ends may send and receive information packets once the link is open
+ * The link starts at BAUDRATE and moves to the fastest rate both ends handle cleanly
+ * @param const char *[in] - port x corresponding to the file /dev/ttySx, or transport:path (see transport.h)
  * @param const uint8_t[in] - determines whether is the RECEIVER or TRANSMITTER called
  * @param int[out] - file descriptor corresponding to the opened file 
  */
 int
-llopen(int port, const uint8_t addr);
+llopen(const char *port, const uint8_t addr);
 
 /***
  * Writes a given chunck of information in the file pointed by the first param
+ * Returns once the frame is sent, blocking only while WINDOW_SIZE frames await acknowledgement
+ * Keeps blocking while the other end has no room left, until it calls llread
+ * Fails with errno ETIMEDOUT once the other end stops answering
  * @param int[in] - file descriptor pointing to the file where information will be written
  * @param uint8_t *[in] - information to be written
  * @param ssize_t[in] - size in bytes of the chunck of information 
@@ -44,6 +52,8 @@ llwrite(int fd, uint8_t *buffer, ssize_t len);
 
 /***
  * Reads a given chunck of information in the file pointed by the first param
+ * Information received while llwrite waited for an acknowledgement is returned first
+ * Fails with errno ENOTCONN, for good, once the channel is closed by the other end
  * @param int[in] - file descriptor pointing to the file where information will be read
  * @param uint8_t *[in] - place where to place the information after performing the reading
  * @param ssize_t[out] - number of bytes read
@@ -53,6 +63,7 @@ llread(int fd, uint8_t *buffer);
 
 /***
  * Reverts to the previous terminal settings and shutdowns all the resources in use
+ * Every frame written is acknowledged before the link is closed
  * @param int[in] - file descriptor corresponding to the opened file 
  * @param int[out] - 0 if no errors occur, negative value otherwise
  */
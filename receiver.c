@@ -11,10 +11,118 @@
 #include <unistd.h>
 
 #include "application.h"
+#include "delta.h"
 #include "protocol.h"
+#include "sha256.h"
 #include "utils.h"
 
 
+static struct sha256 digest;
+
+static const uint8_t *
+find_param(const uint8_t *frag, const ssize_t len, const uint8_t param, const uint8_t size)
+{
+        ssize_t i;
+        for (i = 1; i + 1 < len && i + 2 + frag[i+1] <= len; i += 2 + frag[i+1])
+                if (frag[i] == param && frag[i+1] == size)
+                        return frag + i + 2;
+
+        return NULL;
+}
+
+static void
+write_file(int fd_file, const uint8_t *buf, const ssize_t len)
+{
+        sha256_update(&digest, buf, len);
+        write(fd_file, buf, len);
+}
+
+static int
+verify_digest(const uint8_t *frag, const ssize_t len)
+{
+        const uint8_t *expected;
+        expected = find_param(frag, len, DIGEST, SHA256_SIZE);
+
+        uint8_t actual[SHA256_SIZE];
+        sha256_final(&digest, actual);
+
+        char hex[2 * SHA256_SIZE + 1];
+        int i;
+        for (i = 0; i < SHA256_SIZE; i++)
+                snprintf(hex + 2 * i, 3, "%02x", actual[i]);
+
+        if (expected == NULL) {
+                plog("sha256 %s (not checked, the sender sent no digest)\n", hex);
+                return 0;
+        }
+
+        if (memcmp(expected, actual, SHA256_SIZE) != 0) {
+                perr("sha256 %s does not match the sender's, file is corrupted\n", hex);
+                return -1;
+        }
+
+        plog("sha256 %s verified\n", hex);
+        return 0;
+}
+
+static void
+send_signatures(int fd, int fd_basis, const uint16_t bs)
+{
+        uint8_t frag[MAX_PACKET_SIZE];
+        uint8_t *block = (uint8_t *)malloc(bs);
+        passert(block != NULL, "receiver.c :: malloc", -1);
+
+        uint32_t weak;
+        uint64_t strong;
+        int wb;
+
+        frag[0] = SIGNATURE;
+        frag[1] = 0;
+        while (fd_basis >= 0 && read(fd_basis, block, bs) == bs) {
+                weak = weak_sum(block, bs);
+                strong = strong_sum(block, bs);
+                memcpy(frag + 2 + frag[1] * SIG_SIZE, &weak, sizeof(uint32_t));
+                memcpy(frag + 6 + frag[1] * SIG_SIZE, &strong, sizeof(uint64_t));
+
+                if (++frag[1] == SIGS_PER_PACKET) {
+                        wb = llwrite(fd, frag, 2 + frag[1] * SIG_SIZE);
+                        passert(wb >= 0, "receiver.c :: llwrite", -1);
+                        frag[1] = 0;
+                }
+        }
+
+        if (frag[1] > 0) {
+                wb = llwrite(fd, frag, 2 + frag[1] * SIG_SIZE);
+                passert(wb >= 0, "receiver.c :: llwrite", -1);
+        }
+
+        frag[1] = 0; /* ends the list */
+        wb = llwrite(fd, frag, 2);
+        passert(wb >= 0, "receiver.c :: llwrite", -1);
+
+        free(block);
+}
+
+static void
+copy_blocks(int fd_file, int fd_basis, const uint8_t *frag, const uint16_t bs)
+{
+        uint32_t index;
+        uint16_t count;
+        memcpy(&index, frag + 1, sizeof(uint32_t));
+        memcpy(&count, frag + 5, sizeof(uint16_t));
+
+        uint8_t *block = (uint8_t *)malloc(bs);
+        passert(block != NULL, "receiver.c :: malloc", -1);
+
+        lseek(fd_basis, (off_t)index * bs, SEEK_SET);
+        for (; count > 0; count--) {
+                passert(read(fd_basis, block, bs) == bs, "receiver.c :: read", -1);
+                write_file(fd_file, block, bs);
+        }
+
+        free(block);
+}
+
 int 
 main(int argc, char **argv)
 {
@@ -29,34 +137,58 @@ main(int argc, char **argv)
         srand(begin); /* required in order to make random errors */
 #endif
         
-        int fd_file;
-        fd_file = open(argv[2], O_CREAT | O_WRONLY, 0666);
-        passert(fd_file >= 0, "receiver.c :: open", -1);
-
         int fd;
-        fd = llopen(atoi(argv[1]), RECEIVER);
+        fd = llopen(argv[1], RECEIVER);
         passert(fd >= 0, "receiver.c :: llopen", -1);
 
+        char fname_part[strlen(argv[2]) + 6];
+        snprintf(fname_part, sizeof(fname_part), "%s.part", argv[2]);
+
+        int fd_file = -1, fd_basis = -1;
+        uint16_t bs = 0;
+        int verified = 0;
+
         uint8_t pkgn = 0;
         uint8_t frag[MAX_PACKET_SIZE];
         ssize_t rb, len;
 
         while (1) {
                 rb = llread(fd, frag);
+                passert(rb >= 0 || errno != ENOTCONN, "receiver.c :: llread", -1);
                 if (rb < 0)
                         continue;
 
                 switch (frag[0]) {
                 case DATA:
-                        if (frag[1] > (pkgn % 256)) {
+                        if (frag[1] == pkgn) {
                                 len = frag[2] * 256 + frag[3];
-                                write(fd_file, frag + 4, len);
-                                pkgn++;
+                                write_file(fd_file, frag + 4, len);
+                                pkgn = (pkgn + 1) % 255;
                         }
                         break;
+                case COPY:
+                        copy_blocks(fd_file, fd_basis, frag, bs);
+                        break;
                 case START:
+                        sha256_init(&digest);
+                        if (find_param(frag, rb, BLOCK, sizeof(uint16_t)) != NULL)
+                                memcpy(&bs, find_param(frag, rb, BLOCK, sizeof(uint16_t)), sizeof(uint16_t));
+
+                        if (bs == 0) {
+                                fd_file = open(argv[2], O_CREAT | O_WRONLY | O_TRUNC, 0666);
+                                passert(fd_file >= 0, "receiver.c :: open", -1);
+                                break;
+                        }
+
+                        /* delta mode: the current copy is rebuilt into a new file */
+                        fd_basis = open(argv[2], O_RDONLY);
+                        fd_file = open(fname_part, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+                        passert(fd_file >= 0, "receiver.c :: open", -1);
+
+                        send_signatures(fd, fd_basis, bs);
                         break;
                 case STOP:
+                        verified = verify_digest(frag, rb);
                         llread(fd, frag); /* Take the last disc frame */
                         goto finish;
                 default:
@@ -68,10 +200,15 @@ finish:
         llclose(fd);
         close(fd_file);
 
+        if (bs != 0) {
+                close(fd_basis);
+                if (verified == 0) /* a corrupted copy never replaces the old one */
+                        passert(rename(fname_part, argv[2]) == 0, "receiver.c :: rename", -1);
+        }
+
 #ifdef DEBUG
         eclk(&begin);
 #endif
 
-        return 0;
+        return verified == 0 ? 0 : 2;
 }
-
@@ -12,15 +12,210 @@
 #include <unistd.h>
 
 #include "application.h"
+#include "delta.h"
 #include "protocol.h"
+#include "sha256.h"
 #include "utils.h"
 
+#define AT(off) (window + ((off) - win_base)) /* byte of the file at an offset within the window */
+
+static uint8_t pkgn = 0;
+static struct sha256 digest;
+
+/* part of the file being matched against the receiver's blocks, from win_base onwards */
+static uint8_t window[2 * MAX_BLOCK_SIZE];
+static off_t win_base;
+static size_t win_len;
+
+static void
+send_data(int fd, const uint8_t *buf, ssize_t len)
+{
+        uint8_t frag[MAX_PACKET_SIZE];
+        ssize_t n;
+        int wb;
+
+        while (len > 0) {
+                n = (len < MAX_PACKET_SIZE - 4) ? len : MAX_PACKET_SIZE - 4;
+
+                frag[0] = DATA;
+                frag[1] = pkgn;
+                frag[2] = n / 256;
+                frag[3] = n % 256;
+                memcpy(frag + 4, buf, n);
+
+                wb = llwrite(fd, frag, n + 4);
+                passert(wb >= 0, "sender.c :: llwrite", -1);
+
+                pkgn = (pkgn + 1) % 255;
+                buf += n;
+                len -= n;
+        }
+}
+
+static void
+send_copy(int fd, const uint32_t index, const uint16_t count)
+{
+        uint8_t frag[7];
+
+        frag[0] = COPY;
+        memcpy(frag + 1, &index, sizeof(uint32_t));
+        memcpy(frag + 5, &count, sizeof(uint16_t));
+
+        int wb;
+        wb = llwrite(fd, frag, sizeof(frag));
+        passert(wb >= 0, "sender.c :: llwrite", -1);
+}
+
+static uint32_t
+recv_signatures(int fd, struct signature **sigs)
+{
+        uint8_t frag[MAX_PACKET_SIZE];
+        uint32_t n = 0, cap = 0;
+        ssize_t rb;
+        int i;
+
+        *sigs = NULL;
+        while (1) {
+                rb = llread(fd, frag);
+                passert(rb >= 0, "sender.c :: llread", -1);
+
+                if (frag[0] != SIGNATURE || rb < 2 + frag[1] * SIG_SIZE)
+                        continue;
+                if (frag[1] == 0)
+                        break;
+
+                if (n + frag[1] > cap) {
+                        cap = 2 * cap + SIGS_PER_PACKET;
+                        *sigs = (struct signature *)realloc(*sigs, cap * sizeof(struct signature));
+                        passert(*sigs != NULL, "sender.c :: realloc", -1);
+                }
+
+                for (i = 0; i < frag[1]; i++, n++) {
+                        memcpy(&(*sigs)[n].weak, frag + 2 + i * SIG_SIZE, sizeof(uint32_t));
+                        memcpy(&(*sigs)[n].strong, frag + 6 + i * SIG_SIZE, sizeof(uint64_t));
+                }
+        }
+
+        return n;
+}
+
+static void
+send_file(int fd, int fd_file)
+{
+        uint8_t buf[MAX_PACKET_SIZE - 4];
+        ssize_t rb;
+
+        while ((rb = read(fd_file, buf, sizeof(buf))) > 0) {
+                sha256_update(&digest, buf, rb);
+                send_data(fd, buf, rb);
+        }
+}
+
+static void
+fill_window(int fd_file, const off_t keep, const off_t end, const off_t size)
+{
+        if (win_base + (off_t)win_len >= end)
+                return;
+
+        /* whatever comes before keep is done with, the bytes read are digested once */
+        memmove(window, AT(keep), win_base + win_len - keep);
+        win_len -= keep - win_base;
+        win_base = keep;
+
+        ssize_t rb, n;
+        while (win_base + (off_t)win_len < end) {
+                n = sizeof(window) - win_len;
+                if (n > size - win_base - (off_t)win_len)
+                        n = size - win_base - win_len;
+
+                rb = read(fd_file, window + win_len, n);
+                passert(rb > 0, "sender.c :: read", -1);
+
+                sha256_update(&digest, window + win_len, rb);
+                win_len += rb;
+        }
+}
+
+static void
+send_delta(int fd, int fd_file, const off_t size, const uint16_t bs)
+{
+        struct signature *sigs;
+        uint32_t nsigs;
+        nsigs = recv_signatures(fd, &sigs);
+        passert(delta_index(sigs, nsigs) == 0, "sender.c :: delta_index", -1);
+
+        /* literal data goes in DATA packets as soon as it fills one, matching blocks as COPY references */
+        off_t i, lit = 0;
+        int64_t idx, first = 0;
+        uint16_t count = 0;
+        uint32_t weak = 0;
+
+        win_base = win_len = 0;
+        if (size >= bs) {
+                fill_window(fd_file, 0, bs, size);
+                weak = weak_sum(window, bs);
+        }
+
+        for (i = 0; i + bs <= size; ) {
+                idx = delta_match(weak, AT(i), bs);
+                if (idx < 0) {
+                        if (i + bs < size) {
+                                fill_window(fd_file, lit, i + bs + 1, size);
+                                weak = weak_roll(weak, *AT(i), *AT(i + bs), bs);
+                        }
+                        i++;
+
+                        if (i - lit == MAX_PACKET_SIZE - 4) {
+                                if (count > 0) {
+                                        send_copy(fd, first, count);
+                                        count = 0;
+                                }
+                                send_data(fd, AT(lit), i - lit);
+                                lit = i;
+                        }
+                        continue;
+                }
+
+                if (count > 0 && (lit < i || first + count != idx || count == UINT16_MAX)) {
+                        send_copy(fd, first, count);
+                        count = 0;
+                }
+                send_data(fd, AT(lit), i - lit);
+
+                if (count++ == 0)
+                        first = idx;
+
+                i += bs;
+                lit = i;
+                if (i + bs <= size) {
+                        fill_window(fd_file, i, i + bs, size);
+                        weak = weak_sum(AT(i), bs);
+                }
+        }
+
+        if (count > 0)
+                send_copy(fd, first, count);
+        fill_window(fd_file, lit, size, size);
+        send_data(fd, AT(lit), size - lit);
+#ifdef DEBUG
+        plog("delta: %u blocks of %u bytes known by the receiver\n", nsigs, bs);
+#endif
+        delta_free();
+        free(sigs);
+}
 
 int
 main (int argc, char **argv)
 {
-        if (argc < 3) {
-                fprintf(stderr, "usage: %s <port> <filename>\n", argv[0]);
+        int opt, delta = 0;
+        while ((opt = getopt(argc, argv, "d")) != -1) {
+                if (opt != 'd')
+                        break;
+                delta = 1;
+        }
+
+        if (opt == '?' || argc - optind < 2) {
+                fprintf(stderr, "usage: %s [-d] <port> <filename>\n", argv[0]);
                 return 1;
         }
 
@@ -30,11 +225,11 @@ main (int argc, char **argv)
 #endif
 
         int fd_file;
-        fd_file = open(argv[2], O_RDONLY);
+        fd_file = open(argv[optind+1], O_RDONLY);
         passert(fd_file >= 0, "sender.c :: open", -1);
 
         int fd;
-        fd = llopen(atoi(argv[1]), TRANSMITTER);
+        fd = llopen(argv[optind], TRANSMITTER);
         passert(fd >= 0, "sender.c :: llopen", -1);
 
         uint8_t frag[MAX_PACKET_SIZE];
@@ -48,34 +243,38 @@ main (int argc, char **argv)
         frag[2] = sizeof(off_t);
         memcpy(frag + 3, &size_file, sizeof(off_t));
 
+        ssize_t len = 3 + sizeof(off_t);
+        uint16_t bs = 0;
+        if (delta) {
+                bs = delta_block_size(size_file);
+                frag[len] = BLOCK;
+                frag[len+1] = sizeof(uint16_t);
+                memcpy(frag + len + 2, &bs, sizeof(uint16_t));
+                len += 2 + sizeof(uint16_t);
+        }
+
         int wb;
-        wb = llwrite(fd, frag, 3 + sizeof(off_t));
+        wb = llwrite(fd, frag, len);
         passert(wb >= 0, "sender.c :: llwrite", -1);  
 
-        uint16_t n;
-        n = size_file / (MAX_PACKET_SIZE - 4);
-        n += (size_file % (MAX_PACKET_SIZE - 4));
-
-        ssize_t rb;
-        int i;
-        for (i = 0; i < n; i++) {
-                rb = read(fd_file, frag + 4, MAX_PACKET_SIZE - 4);    
-
-                frag[0] = DATA;
-                frag[1] = i % 255;
-                frag[2] = rb / 256;
-                frag[3] = rb % 256;
-
-                wb = llwrite(fd, frag, rb + 4);
-                passert(wb >= 0, "sender.c :: llwrite", -1);
-        }
+        sha256_init(&digest);
+        if (delta)
+                send_delta(fd, fd_file, size_file, bs);
+        else
+                send_file(fd, fd_file);
 
         frag[0] = STOP;
         frag[1] = SIZE;
         frag[2] = sizeof(off_t);
         memcpy(frag + 3, &size_file, sizeof(off_t));
 
-        wb = llwrite(fd, frag, 3 + sizeof(off_t));
+        len = 3 + sizeof(off_t);
+        frag[len] = DIGEST;
+        frag[len+1] = SHA256_SIZE;
+        sha256_final(&digest, frag + len + 2);
+        len += 2 + SHA256_SIZE;
+
+        wb = llwrite(fd, frag, len);
         passert(wb >= 0, "sender.c :: llwrite", -1);
 
         llclose(fd);
@@ -87,4 +286,3 @@ main (int argc, char **argv)
 
         return 0;
 }
-
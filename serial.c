@@ -0,0 +1,108 @@
+/*
+ * serial.c
+ * Serial port protocol termios transport
+ * RC @ L.EIC 2122
+ * Authors: Miguel Rodrigues & Nuno Castro
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "transport.h"
+#include "utils.h"
+
+/* global variables */
+static struct termios oldtio, newtio;
+
+
+static int
+serial_open(const char *path, const int server)
+{
+        int fd;
+        fd = open(path, O_RDWR | O_NOCTTY);
+        if (fd < 0)
+                return -1;
+
+        if (tcgetattr(fd, &oldtio) < 0)
+                return -1;
+
+        memset(&newtio, '\0', sizeof(newtio));
+
+        newtio.c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
+        newtio.c_iflag = IGNPAR;
+        newtio.c_oflag = 0;
+        newtio.c_lflag = 0; /* set input mode (non-canonical, no echo...) */
+
+        newtio.c_cc[VTIME] = 0;
+        newtio.c_cc[VMIN] = 1; /* 1 char required to satisfy a read */
+
+        tcflush(fd, TCIOFLUSH);
+        if (tcsetattr(fd, TCSANOW, &newtio) == -1)
+                return -1;
+#ifdef DEBUG
+        plog("termios struct set with success\n");
+#endif
+        return fd;
+}
+
+static ssize_t
+serial_read(int fd, uint8_t *buf, const size_t len)
+{
+        return read(fd, buf, len);
+}
+
+static ssize_t
+serial_write(int fd, const uint8_t *buf, const size_t len)
+{
+        return write(fd, buf, len);
+}
+
+static int
+serial_wait(int fd, const int ms)
+{
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        return poll(&pfd, 1, ms);
+}
+
+static int
+serial_drain(int fd)
+{
+        return tcdrain(fd);
+}
+
+static int
+serial_configure(int fd, const speed_t speed)
+{
+        struct termios tio;
+        cfsetispeed(&newtio, speed);
+        cfsetospeed(&newtio, speed);
+
+        /* drivers that can't do a rate either refuse it or settle for another */
+        if (tcsetattr(fd, TCSADRAIN, &newtio) < 0 || tcgetattr(fd, &tio) < 0)
+                return -1;
+
+        return cfgetospeed(&tio) == speed ? 0 : -1;
+}
+
+static int
+serial_close(int fd)
+{
+        if (tcsetattr(fd, TCSANOW, &oldtio) < 0)
+                return -1;
+
+        close(fd);
+        return 0;
+}
+
+const struct transport serial_transport = {
+        .name = "serial",
+        .open = serial_open,
+        .read = serial_read,
+        .write = serial_write,
+        .wait = serial_wait,
+        .drain = serial_drain,
+        .configure = serial_configure,
+        .close = serial_close,
+};
@@ -0,0 +1,45 @@
+/*
+ * sha256.h
+ * Serial port protocol streaming SHA-256 digest
+ * RC @ L.EIC 2122
+ * Authors: Miguel Rodrigues & Nuno Castro
+ */
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+
+/* Digest state, fed incrementally as the file is read or written */
+struct sha256 {
+        uint32_t h[8];
+        uint64_t len;
+        uint8_t block[64];
+        size_t fill;
+};
+
+/***
+ * Resets the digest state
+ * @param struct sha256 *[in] - digest state
+ */
+void sha256_init(struct sha256 *ctx);
+
+/***
+ * Feeds a chunck of information to the digest
+ * @param struct sha256 *[in] - digest state
+ * @param const uint8_t *[in] - information to be digested
+ * @param size_t[in] - size in bytes of the chunck of information
+ */
+void sha256_update(struct sha256 *ctx, const uint8_t *buf, size_t len);
+
+/***
+ * Finishes the digest
+ * @param struct sha256 *[in] - digest state
+ * @param uint8_t *[out] - SHA256_SIZE bytes of digest
+ */
+void sha256_final(struct sha256 *ctx, uint8_t *digest);
+
+#endif /* _SHA256_H_ */
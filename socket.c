@@ -0,0 +1,229 @@
+/*
+ * socket.c
+ * Serial port protocol socket transports
+ * RC @ L.EIC 2122
+ * Authors: Miguel Rodrigues & Nuno Castro
+ */
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "transport.h"
+#include "utils.h"
+
+/* macros */
+#define CONNECT_TRIES (TOUT * 10) /* 100 ms apart, the other end may not be listening yet */
+#define MAX_LISTEN 8 /* addresses a name may stand for */
+
+
+static int
+sock_listen(const struct addrinfo *ai)
+{
+        struct pollfd pfd[MAX_LISTEN];
+        const struct addrinfo *p;
+        int n = 0, i, fd = -1, on = 1, inet = 0;
+
+        for (p = ai; p != NULL; p = p->ai_next)
+                inet |= p->ai_family == AF_INET;
+
+        /* on every address given, as the other end may reach this one through any of them */
+        for (p = ai; p != NULL && n < MAX_LISTEN; p = p->ai_next) {
+                pfd[n].fd = socket(p->ai_family, SOCK_STREAM, 0);
+                if (pfd[n].fd < 0)
+                        continue;
+
+                setsockopt(pfd[n].fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+                if (p->ai_family == AF_INET6 && inet) /* leaves IPv4 to its own socket */
+                        setsockopt(pfd[n].fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+                if (bind(pfd[n].fd, p->ai_addr, p->ai_addrlen) < 0 || listen(pfd[n].fd, 1) < 0) {
+                        close(pfd[n].fd);
+                        continue;
+                }
+                pfd[n++].events = POLLIN;
+        }
+
+        /* a link has a single peer */
+        if (n > 0 && poll(pfd, n, -1) > 0)
+                for (i = 0; i < n && fd < 0; i++)
+                        if (pfd[i].revents & POLLIN)
+                                fd = accept(pfd[i].fd, NULL, NULL);
+
+        for (i = 0; i < n; i++)
+                close(pfd[i].fd);
+        return fd;
+}
+
+static int
+sock_connect(const struct addrinfo *ai)
+{
+        const struct addrinfo *p;
+        int fd, i;
+
+        for (i = 0; i < CONNECT_TRIES; i++) {
+                for (p = ai; p != NULL; p = p->ai_next) {
+                        fd = socket(p->ai_family, SOCK_STREAM, 0);
+                        if (fd < 0)
+                                continue;
+
+                        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+                                return fd;
+                        close(fd);
+                }
+                usleep(100000);
+        }
+
+        return -1;
+}
+
+static int
+unix_open(const char *path, const int server)
+{
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+
+        if (strlen(path) >= sizeof(sa.sun_path))
+                return -1;
+        strcpy(sa.sun_path, path);
+
+        struct addrinfo ai;
+        memset(&ai, 0, sizeof(ai));
+        ai.ai_family = AF_UNIX;
+        ai.ai_addr = (struct sockaddr *)&sa;
+        ai.ai_addrlen = sizeof(sa);
+
+        if (!server)
+                return sock_connect(&ai);
+
+        unlink(path); /* left behind by an earlier run */
+        int fd;
+        fd = sock_listen(&ai);
+        unlink(path);
+        return fd;
+}
+
+static int
+tcp_open(const char *path, const int server)
+{
+        /* path is host:port, the host may be left out by the end listening */
+        const char *sep = strrchr(path, ':');
+        if (sep == NULL)
+                return -1;
+
+        char host[sep - path + 1];
+        memcpy(host, path, sep - path);
+        host[sep - path] = '\0';
+
+        struct addrinfo hints, *ai;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = server ? AI_PASSIVE : 0;
+
+        if (getaddrinfo(host[0] ? host : NULL, sep + 1, &hints, &ai) != 0)
+                return -1;
+
+        int fd, on = 1;
+        fd = server ? sock_listen(ai) : sock_connect(ai);
+        freeaddrinfo(ai);
+
+        /* frames are small and already acknowledged in batches */
+        if (fd >= 0)
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        return fd;
+}
+
+static int
+fd_open(const char *path, const int server)
+{
+        /* a descriptor inherited already connected, e.g. one end of a socketpair */
+        char *end;
+        long fd = strtol(path, &end, 10);
+        if (*path == '\0' || *end != '\0' || fd < 0 || fcntl(fd, F_GETFD) < 0)
+                return -1;
+
+        return fd;
+}
+
+static ssize_t
+sock_read(int fd, uint8_t *buf, const size_t len)
+{
+        return read(fd, buf, len);
+}
+
+static ssize_t
+sock_write(int fd, const uint8_t *buf, const size_t len)
+{
+        size_t done = 0;
+        ssize_t wb;
+
+        while (done < len) {
+                wb = send(fd, buf + done, len - done, MSG_NOSIGNAL);
+                if (wb < 0 && errno != EINTR)
+                        return -1;
+                if (wb > 0)
+                        done += wb;
+        }
+
+        return done;
+}
+
+static int
+sock_wait(int fd, const int ms)
+{
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        return poll(&pfd, 1, ms);
+}
+
+static int
+sock_drain(int fd)
+{
+        return 0; /* the kernel still delivers what was sent after close */
+}
+
+static int
+sock_close(int fd)
+{
+        return close(fd);
+}
+
+const struct transport unix_transport = {
+        .name = "unix",
+        .open = unix_open,
+        .read = sock_read,
+        .write = sock_write,
+        .wait = sock_wait,
+        .drain = sock_drain,
+        .configure = NULL,
+        .close = sock_close,
+};
+
+const struct transport tcp_transport = {
+        .name = "tcp",
+        .open = tcp_open,
+        .read = sock_read,
+        .write = sock_write,
+        .wait = sock_wait,
+        .drain = sock_drain,
+        .configure = NULL,
+        .close = sock_close,
+};
+
+const struct transport fd_transport = {
+        .name = "fd",
+        .open = fd_open,
+        .read = sock_read,
+        .write = sock_write,
+        .wait = sock_wait,
+        .drain = sock_drain,
+        .configure = NULL,
+        .close = sock_close,
+};
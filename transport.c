@@ -0,0 +1,50 @@
+/*
+ * transport.c
+ * Serial port protocol transports
+ * RC @ L.EIC 2122
+ * Authors: Miguel Rodrigues & Nuno Castro
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "transport.h"
+
+/* global variables */
+static const struct transport *transports[] = {
+        &serial_transport, &unix_transport, &tcp_transport, &fd_transport, &memory_transport,
+};
+#define N_TRANSPORTS (int)(sizeof(transports) / sizeof(transports[0]))
+
+static char tty[32];
+
+
+const struct transport *
+transport_find(const char *port, const char **path)
+{
+        const char *sep = strchr(port, ':');
+        if (sep == NULL) {
+                /* only a port number, anything else would silently open the wrong device */
+                char *end;
+                long n = strtol(port, &end, 10);
+                if (*port < '0' || *port > '9' || *end != '\0' || n > INT_MAX)
+                        return NULL;
+
+                snprintf(tty, sizeof(tty), "/dev/ttyS%ld", n);
+                *path = tty;
+                return &serial_transport;
+        }
+
+        int i;
+        for (i = 0; i < N_TRANSPORTS; i++) {
+                if (strlen(transports[i]->name) == (size_t)(sep - port)
+                    && strncmp(transports[i]->name, port, sep - port) == 0) {
+                        *path = sep + 1;
+                        return transports[i];
+                }
+        }
+
+        return NULL;
+}
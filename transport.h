@@ -0,0 +1,77 @@
+/*
+ * transport.h
+ * Serial port protocol transports
+ * RC @ L.EIC 2122
+ * Authors: Miguel Rodrigues & Nuno Castro
+ */
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <termios.h>
+
+/* Byte channel the link layer runs on, one open at a time per process */
+struct transport {
+        const char *name; /* prefix selecting it in a port, as in name:path */
+
+        /***
+         * Opens the channel named by path
+         * @param const char *[in] - channel's path, meaning depends on the transport
+         * @param const int[in] - 1 for the end that waits for the other one to show up
+         * @param int[out] - file descriptor of the channel, negative value on error
+         */
+        int (*open)(const char *path, const int server);
+
+        /***
+         * Reads at least 1 byte, blocking until there is one
+         * @param int[out] - number of bytes read, -1 with errno EINTR if a signal came first
+         */
+        ssize_t (*read)(int fd, uint8_t *buf, const size_t len);
+
+        /***
+         * Writes the whole buffer, may be called from the SIGALRM handler
+         * @param ssize_t[out] - number of bytes written, negative value on error
+         */
+        ssize_t (*write)(int fd, const uint8_t *buf, const size_t len);
+
+        /***
+         * Waits for input to read
+         * @param int[out] - 1 if there is input, 0 on timeout, -1 if a signal came first
+         */
+        int (*wait)(int fd, const int ms);
+
+        /***
+         * Waits until everything written has left this end
+         */
+        int (*drain)(int fd);
+
+        /***
+         * Changes the line rate, after the bytes already written have left at the old one
+         * NULL for transports without a line rate
+         * @param int[out] - 0 if the channel now runs at speed, negative value otherwise
+         */
+        int (*configure)(int fd, const speed_t speed);
+
+        /***
+         * Reverts whatever open changed and closes the channel
+         */
+        int (*close)(int fd);
+};
+
+extern const struct transport serial_transport;
+extern const struct transport unix_transport, tcp_transport, fd_transport;
+extern const struct transport memory_transport;
+
+/***
+ * Finds the transport of a port given as name:path
+ * A bare number x is the serial port /dev/ttySx
+ * @param const char *[in] - port
+ * @param const char **[out] - path to be opened by the transport
+ * @param const struct transport *[out] - transport, NULL if the name is unknown or x not a number
+ */
+const struct transport *
+transport_find(const char *port, const char **path);
+
+#endif /* _TRANSPORT_H_ */